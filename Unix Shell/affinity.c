@@ -0,0 +1,418 @@
+////////////////////////////////////////////////////////////////////////////////
+/// Per-command CPU affinity and scheduling for pipeline stages
+/// @author Thomas Pelegrin
+/// @date 10.19.2023
+////////////////////////////////////////////////////////////////////////////////
+
+/***************************** Imports ****************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "util.h"
+#include "affinity.h"
+
+/**************************** Constants ***************************************/
+
+#define TOPOLOGY_PATH "/sys/devices/system/cpu/cpu%d/topology/%s"
+
+#define MIN_NICE -20
+#define MAX_NICE 19
+
+/*******************************************************************************
+ *                       Type and Struct Definitions
+ ******************************************************************************/
+
+typedef struct cpu_topo_s cpu_topo_t;
+
+struct cpu_topo_s
+{ /* where a cpu sits in the machine */
+    int cpu;
+    int package;    // physical package (socket) -- shares the last level cache
+    int core;       // physical core within the package
+    int thread;     // SMT thread index within the core
+};
+
+/***************************** Globals ****************************************/
+
+static int pin_auto = FALSE;            // place pipeline stages automatically
+static int cpu_order[ CPU_SETSIZE ];    // cpus in auto placement order
+static int n_cpus = -1;                 // -1 until the topology is loaded
+static int cpu_package[ CPU_SETSIZE ];  // the package of each cpu_order slot
+static pid_t slot_owner[ CPU_SETSIZE ]; // & stage holding each slot, else 0
+
+/*******************************************************************************
+ *                            Functions
+ ******************************************************************************/
+
+/// @brief Parses a cpu list such as 2-3,5 into a cpu set
+/// @param text the cpu list
+/// @param out_cpus the cpu set to fill (output)
+/// @return 0 if SUCCESS, else 1 for ERROR
+static int parse_cpu_list(string_t text, cpu_set_t * out_cpus)
+{
+    char * end = NULL;
+    long lo = 0;
+    long hi = 0;
+
+    CPU_ZERO( out_cpus );
+
+    do
+    { /* each entry is either a cpu or a lo-hi range */
+        lo = hi = strtol( text, &end, 10 );
+
+        if (end == text)
+        {
+            return ERROR;
+        }
+        if (*end == '-')
+        {
+            text = end + 1;
+            hi = strtol( text, &end, 10 );
+
+            if (end == text)
+            {
+                return ERROR;
+            }
+        }
+        if (lo < 0 || hi >= CPU_SETSIZE || lo > hi)
+        {
+            return ERROR;
+        }
+        for (long cpu = lo; cpu <= hi; cpu++)
+        {
+            CPU_SET( cpu, out_cpus );
+        }
+        text = end + 1;
+    } while (*end == ',');
+
+    return *end == '\0' ? SUCCESS : ERROR;
+}
+
+/// @brief Checks whether an argument is a stage annotation; any other word,
+///        even one starting with @ (dig @8.8.8.8), goes to the program
+/// @param text the argument text
+/// @return TRUE if it starts with @cpu= or @nice=, else FALSE
+int is_sched_annotation(string_t text)
+{
+    return !strncmp( text, "@cpu=", 5 ) || !strncmp( text, "@nice=", 6 );
+}
+
+/// @brief Parses a stage annotation (@cpu=2-3 or @nice=5) into the plan
+/// @param plan_p the scheduling plan of the command
+/// @param text the annotation text, including the @
+/// @return 0 if SUCCESS, else 1 for ERROR
+int parse_sched_annotation(sched_plan_t * plan_p, string_t text)
+{
+    START_FUNC;
+
+    int result = SUCCESS;
+    char * end = NULL;
+    long nice = 0;
+    cpu_set_t cpus;
+
+    if (!strncmp( text, "@cpu=", 5 ))
+    { /* parse aside so a bad list doesn't clobber an earlier @cpu= */
+        if (!(result = parse_cpu_list( &text[ 5 ], &cpus )))
+        {
+            plan_p->cpus = cpus;
+            plan_p->flags |= PIN_CPU;
+        }
+    } else if (!strncmp( text, "@nice=", 6 ))
+    {
+        nice = strtol( &text[ 6 ], &end, 10 );
+
+        if (end == &text[ 6 ] || *end != '\0'
+            || nice < MIN_NICE || nice > MAX_NICE)
+        {
+            result = ERROR;
+        } else
+        {
+            plan_p->nice = nice;
+            plan_p->flags |= PIN_NICE;
+        }
+    } else
+    {
+        result = ERROR;
+    }
+    END_FUNC;
+
+    return result;
+}
+
+/// @brief Prints a cpu set as a compact cpu list (e.g. 0-3,6)
+/// @param cpus the cpu set to print
+static void print_cpu_list(cpu_set_t * cpus)
+{
+    char * sep = "";
+    int lo = 0;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET( cpu, cpus ))
+        { /* walk to the end of the range and print it */
+            for (lo = cpu; cpu + 1 < CPU_SETSIZE && CPU_ISSET( cpu + 1, cpus );)
+            {
+                cpu++;
+            }
+            printf( lo == cpu ? "%s%d" : "%s%d-%d", sep, lo, cpu );
+            sep = ",";
+        }
+    }
+}
+
+/// @brief Prints the plan's annotations the way they were typed
+/// @param plan_p the scheduling plan of the command
+void print_sched_plan(sched_plan_t * plan_p)
+{
+    if (plan_p->flags & PIN_CPU)
+    {
+        printf( "@cpu=" );
+        print_cpu_list( &plan_p->cpus );
+        printf( " " );
+    }
+    if (plan_p->flags & PIN_NICE)
+    {
+        printf( "@nice=%d ", plan_p->nice );
+    }
+}
+
+/// @brief Applies the plan to the calling process (a child, before exec)
+/// @param plan_p the scheduling plan of the command
+/// @return 0 if SUCCESS, else 1 for ERROR (the command should still run)
+int apply_sched_plan(sched_plan_t * plan_p)
+{
+    START_FUNC;
+
+    int result = SUCCESS;
+
+    if (plan_p->flags & PIN_CPU
+        && sched_setaffinity( 0, sizeof( plan_p->cpus ), &plan_p->cpus ) < 0)
+    {
+        PRINT_ERROR( "sched_setaffinity failed" );
+        result = ERROR;
+    }
+    if (plan_p->flags & PIN_NICE
+        && setpriority( PRIO_PROCESS, 0, plan_p->nice ) < 0)
+    { /* lowering nice below the current value needs privileges */
+        PRINT_ERROR( "setpriority failed" );
+        result = ERROR;
+    }
+    END_FUNC;
+
+    return result;
+}
+
+/// @brief Reads an integer topology attribute of a cpu from sysfs
+/// @param cpu the cpu to read the attribute of
+/// @param name the name of the attribute
+/// @return the value of the attribute, else -1 if unavailable
+static int read_topology(int cpu, string_t name)
+{
+    char path[ 128 ];
+    FILE * file = NULL;
+    int value = -1;
+
+    snprintf( path, sizeof( path ), TOPOLOGY_PATH, cpu, name );
+
+    if ((file = fopen( path, "r" )))
+    {
+        if (fscanf( file, "%d", &value ) != 1)
+        {
+            value = -1;
+        }
+        fclose( file );
+    }
+    return value;
+}
+
+/// @brief Orders cpus by package, then SMT thread, then core
+/// @param a the first cpu_topo_t
+/// @param b the second cpu_topo_t
+/// @return negative, zero, or positive as in qsort
+static int cmp_topology(const void * a, const void * b)
+{
+    const cpu_topo_t * x = a;
+    const cpu_topo_t * y = b;
+
+    if (x->package != y->package)
+    {
+        return x->package - y->package;
+    }
+    if (x->thread != y->thread)
+    {
+        return x->thread - y->thread;
+    }
+    if (x->core != y->core)
+    {
+        return x->core - y->core;
+    }
+    return x->cpu - y->cpu;
+}
+
+/// @brief Builds the auto placement order from the shell's allowed cpus.
+///        Adjacent stages land on sibling cores of the same package so they
+///        hand data over through a shared cache; the second SMT thread of a
+///        core is only used once every core of the package has a stage.
+static void load_topology(void)
+{
+    START_FUNC;
+
+    cpu_set_t allowed;
+    cpu_topo_t topo[ CPU_SETSIZE ];
+
+    n_cpus = 0;
+
+    if (sched_getaffinity( 0, sizeof( allowed ), &allowed ) < 0)
+    {
+        PRINT_ERROR( "sched_getaffinity failed" );
+        return;
+    }
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET( cpu, &allowed ))
+        { /* missing sysfs entries put every cpu on one package/core */
+            topo[ n_cpus ].cpu = cpu;
+            topo[ n_cpus ].package = read_topology( cpu, "physical_package_id" );
+            topo[ n_cpus ].core = read_topology( cpu, "core_id" );
+            topo[ n_cpus ].thread = 0;
+
+            for (int i = 0; i < n_cpus; i++)
+            { /* count the earlier threads of the same core */
+                if (topo[ i ].package == topo[ n_cpus ].package
+                    && topo[ i ].core == topo[ n_cpus ].core)
+                {
+                    topo[ n_cpus ].thread++;
+                }
+            }
+            n_cpus++;
+        }
+    }
+    qsort( topo, n_cpus, sizeof( cpu_topo_t ), cmp_topology );
+
+    for (int i = 0; i < n_cpus; i++)
+    {
+        cpu_order[ i ] = topo[ i ].cpu;
+        cpu_package[ i ] = topo[ i ].package;
+    }
+    END_FUNC;
+}
+
+/// @brief Turns automatic placement of pipeline stages on or off
+/// @param enabled TRUE to enable, FALSE to disable
+void set_pin_auto(int enabled)
+{
+    pin_auto = enabled;
+}
+
+/// @brief Checks whether pipeline stages are placed automatically
+/// @return TRUE if enabled, else FALSE
+int pin_auto_enabled(void)
+{
+    return pin_auto;
+}
+
+/// @brief Picks the slot in the auto placement order where a pipeline's first
+///        stage goes. The pipeline gets consecutive slots, never wrapping
+///        past the end of the order and, if it fits, never leaving the
+///        package; slots still held by running & pipelines are skipped.
+///        With no & pipelines running, every pipeline starts at slot 0.
+/// @param n_stages the number of stages in the pipeline
+/// @return the first slot of the pipeline, else -1 if there is no topology
+int auto_place_pipeline(int n_stages)
+{
+    START_FUNC;
+
+    int base = -1;
+    int is_free = TRUE;
+
+    if (n_cpus < 0)
+    { /* the topology is only read the first time it is needed */
+        load_topology();
+    }
+
+    if (n_cpus > 0)
+    { /* too many stages to fit means wrapping anyway, so start at slot 0 */
+        base = 0;
+    }
+
+    for (int pass = 0; pass < 2 && n_stages < n_cpus; pass++)
+    { /* pass 0 keeps the pipeline in one package, pass 1 only keeps it free */
+        for (int slot = 0; slot + n_stages <= n_cpus; slot++)
+        {
+            is_free = pass == 1
+                || cpu_package[ slot ] == cpu_package[ slot + n_stages - 1 ];
+
+            for (int i = slot; i < slot + n_stages && is_free; i++)
+            {
+                is_free = slot_owner[ i ] == 0;
+            }
+            if (is_free)
+            {
+                base = slot;
+                goto FUNC_EXIT;
+            }
+        }
+    }
+FUNC_EXIT:
+    END_FUNC;
+
+    return base;
+}
+
+/// @brief Pins a pipeline stage to its slot in the auto placement order,
+///        unless the stage was given an explicit @cpu=
+/// @param plan_p the scheduling plan of the stage (a copy, it is modified)
+/// @param slot the stage's slot (first slot of the pipeline + stage index)
+void auto_place_stage(sched_plan_t * plan_p, int slot)
+{
+    if (!(plan_p->flags & PIN_CPU) && n_cpus > 0)
+    {
+        CPU_ZERO( &plan_p->cpus );
+        CPU_SET( cpu_order[ slot % n_cpus ], &plan_p->cpus );
+        plan_p->flags |= PIN_CPU;
+    }
+}
+
+/// @brief Marks a slot as held by a running & pipeline stage
+/// @param slot the stage's slot
+/// @param pid the pid of the stage
+void hold_pin_slot(int slot, pid_t pid)
+{
+    if (n_cpus > 0)
+    {
+        slot_owner[ slot % n_cpus ] = pid;
+    }
+}
+
+/// @brief Frees any slot held by a stage once it has been reaped
+/// @param pid the pid of the reaped stage
+void release_pin_slot(pid_t pid)
+{
+    for (int i = 0; i < n_cpus; i++)
+    {
+        if (slot_owner[ i ] == pid)
+        {
+            slot_owner[ i ] = 0;
+        }
+    }
+}
+
+/// @brief Prints whether auto placement is on and the order it uses
+void print_pin_status(void)
+{
+    if (n_cpus < 0)
+    {
+        load_topology();
+    }
+    printf( "pin %s, stage order:", pin_auto ? "auto" : "off" );
+
+    for (int i = 0; i < n_cpus; i++)
+    {
+        printf( " %d", cpu_order[ i ] );
+    }
+    printf( "\n" );
+}
@@ -0,0 +1,26 @@
+////////////////////////////////////////////////////////////////////////////////
+/// Per-command CPU affinity and scheduling for pipeline stages
+/// @author Thomas Pelegrin
+/// @date 10.19.2023
+////////////////////////////////////////////////////////////////////////////////
+
+/***************************** Imports ****************************************/
+
+#include "util.h"
+
+/*******************************************************************************
+ *                          Public Functions
+ ******************************************************************************/
+
+int is_sched_annotation(string_t);
+int parse_sched_annotation(sched_plan_t *, string_t);
+void print_sched_plan(sched_plan_t *);
+int apply_sched_plan(sched_plan_t *);
+
+void set_pin_auto(int);
+int pin_auto_enabled(void);
+int auto_place_pipeline(int);
+void auto_place_stage(sched_plan_t *, int);
+void hold_pin_slot(int, pid_t);
+void release_pin_slot(pid_t);
+void print_pin_status(void);
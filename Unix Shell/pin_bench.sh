@@ -0,0 +1,45 @@
+#!/bin/sh
+################################################################################
+## Times a 4-stage compression pipeline run by the shell, unpinned versus
+## pinned with pin auto. Needs a multi-core host to show any difference.
+## Usage: ./pin_bench.sh [SIZE_MB] [RUNS] [SHELL_FLAGS]
+## @author Thomas Pelegrin
+## @date 10.19.2023
+################################################################################
+
+SIZE_MB=${1:-64}
+RUNS=${2:-5}
+FLAGS=${3:-}
+SHELL_BIN=$(cd "$(dirname "$0")" && pwd)/shell
+PIPELINE="cat in.txt | gzip -1 | gzip -d | gzip -1 > out.gz"
+
+if [ ! -x "$SHELL_BIN" ]; then
+    echo "build the shell first (make)" >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d) || exit 1
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+
+# base64 of random bytes: compressible, but not trivially so
+head -c $((SIZE_MB * 1024 * 1024 * 3 / 4)) /dev/urandom | base64 > in.txt
+
+# run_pipeline MODE -- prints the wall time of one run in ms
+run_pipeline() {
+    start=$(date +%s%N)
+    printf 'pin %s\n%s\nquit\n' "$1" "$PIPELINE" | "$SHELL_BIN" $FLAGS > /dev/null
+    end=$(date +%s%N)
+    echo $(( (end - start) / 1000000 ))
+}
+
+echo "$(nproc) cpus, ${SIZE_MB} MB input, $RUNS runs: $PIPELINE"
+
+for mode in off auto; do
+    total=0
+    for i in $(seq "$RUNS"); do
+        total=$(( total + $(run_pipeline $mode) ))
+    done
+    ms=$(( total / RUNS ))
+    echo "pin $mode: ${ms} ms/run, $(( SIZE_MB * 1000 / (ms > 0 ? ms : 1) )) MB/s"
+done
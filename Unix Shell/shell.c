@@ -13,10 +13,13 @@
 #include <fcntl.h>
 #include <sys/wait.h>
 #include "util.h"
+#include "zygote.h"
+#include "affinity.h"
 
 /**************************** Constants ***************************************/
 
 #define HIST_SIZE 5
+#define ANNOTATION_ERROR "invalid annotation, expected @cpu=LIST or @nice=N"
 
 /*******************************************************************************
  *                            Functions
@@ -26,29 +29,43 @@
 /// @param cmd_p the command to add the argument to
 /// @param in_buf the input buffer
 /// @param len the length of the argument text
-void extract_arg(cmd_t * cmd_p, string_t in_buf, int len)
+/// @return 0 if SUCCESS, else 1 for ERROR (a malformed annotation)
+int extract_arg(cmd_t * cmd_p, string_t in_buf, int len)
 {
     START_FUNC;
 
+    int result = SUCCESS;
     char arg_str[ len + 1 ];        // temp argument string
 
     /* copys the arg string and terminates it */
     strncpy( arg_str, in_buf, len );
     arg_str[ len ] = '\0';
 
-    /* add_arg will allocate for a for and make a copy of temp */
-    add_arg_to_cmd( cmd_p, arg_str );
+    if (is_sched_annotation( arg_str ))
+    { /* stage annotations (@cpu=, @nice=) are not passed to the program */
+        if ((result = parse_sched_annotation( &cmd_p->sched, arg_str )))
+        {
+            PRINT_ERROR( ANNOTATION_ERROR );
+        }
+    } else
+    { /* add_arg will allocate for a for and make a copy of temp */
+        add_arg_to_cmd( cmd_p, arg_str );
+    }
 
     END_FUNC;
+
+    return result;
 }
 
 /// @brief Extracts the commands from input and adds them to cmd_set
 /// @param in_buf the input buffer
 /// @param cmd_set_pp the command set to add commands to
-void extract_cmds(string_t in_buf, cmd_set_t ** cmd_set_pp)
+/// @return 0 if SUCCESS, else 1 for ERROR (the command set must not run)
+int extract_cmds(string_t in_buf, cmd_set_t ** cmd_set_pp)
 {
     START_FUNC;
 
+    int result = SUCCESS;
     int length = 0;
     int i = 0;
     cmd_t * curr_cmd_p = NULL;
@@ -66,7 +83,8 @@ void extract_cmds(string_t in_buf, cmd_set_t ** cmd_set_pp)
 
             } else if (length > 0)
             { /* add the argument to the command */
-                extract_arg( curr_cmd_p, &in_buf[ i - length ], length );
+                result |= extract_arg( curr_cmd_p, &in_buf[ i - length ],
+                    length );
             }
             length = 0;
 
@@ -90,7 +108,8 @@ void extract_cmds(string_t in_buf, cmd_set_t ** cmd_set_pp)
         { /* add the last argument to the command */
             if (length > 0 || i == 1)
             {
-                extract_arg( curr_cmd_p, &in_buf[ i - length ], length );
+                result |= extract_arg( curr_cmd_p, &in_buf[ i - length ],
+                    length );
             }
             length = 0;
 
@@ -100,7 +119,19 @@ void extract_cmds(string_t in_buf, cmd_set_t ** cmd_set_pp)
         }
         i++;
     }
+
+    for (curr_cmd_p = (*cmd_set_pp)->head; curr_cmd_p; 
+        curr_cmd_p = curr_cmd_p->next)
+    { /* an annotation needs a program to apply to (e.g. echo a | @nice=1) */
+        if (curr_cmd_p->sched.flags && !curr_cmd_p->head)
+        {
+            PRINT_ERROR( ANNOTATION_ERROR );
+            result = ERROR;
+        }
+    }
     END_FUNC;
+
+    return result;
 }
 
 /// @brief Converts a commands arguments to array of strings
@@ -154,6 +185,7 @@ void print_history(cmd_set_t * hist[], int cmd_num)
                 printf( "%s ", arg->text );
                 arg = arg->next;
             }
+            print_sched_plan( &curr_cmd_p->sched );
 
             if (curr_cmd_p->handler_flags & (R_PIPE | W_PIPE) 
                 && curr_cmd_p->next)
@@ -198,6 +230,27 @@ int fetch_cmd_set(string_t in_buf, cmd_set_t * hist[], int cmd_num,
     return result;
 }
 
+/// @brief Handles the pin builtin: pin auto, pin off, or pin for the status
+/// @param in_buf the input buffer
+void pin_builtin(string_t in_buf)
+{
+    START_FUNC;
+
+    if (strstr( &in_buf[ 3 ], "auto" ))
+    {
+        set_pin_auto( TRUE );
+    } else if (strstr( &in_buf[ 3 ], "off" ))
+    {
+        set_pin_auto( FALSE );
+    } else if (in_buf[ 3 ] != '\n')
+    {
+        printf( "Usage: pin [auto|off]\n" );
+    }
+    print_pin_status();
+
+    END_FUNC;
+}
+
 /// @brief Returns the number of occurrences of a command set in history
 /// @param hist the history array
 /// @param cmd_p the command set you are checking for duplicates of
@@ -251,7 +304,8 @@ void setup_pipes(cmd_t * cmd_p)
 
 /// @brief Executes the command
 /// @param cmd_p the command to execute
-void exec_cmd(cmd_t * cmd_p)
+/// @param sched_p the scheduling plan for the command
+void exec_cmd(cmd_t * cmd_p, sched_plan_t * sched_p)
 {
     START_FUNC;
 
@@ -259,6 +313,8 @@ void exec_cmd(cmd_t * cmd_p)
     string_t args[ cmd_p->argc ];
     args_to_array( cmd_p, args );
 
+    apply_sched_plan( sched_p );    // pin and renice before redirecting
+
     /* A command will never read before writing command happens */
     if (cmd_p->handler_flags & R_PIPE)
     { /* redirects STDIN to the read end of the pipe */
@@ -297,38 +353,108 @@ void exec_cmd(cmd_t * cmd_p)
     }
 }
 
+/// @brief Spawns the command through the zygote instead of forking the shell
+/// @param cmd_p the command to execute
+/// @param sched_p the scheduling plan for the command
+/// @param out_pid_p where to store the pid of the command (output)
+/// @return 0 if SUCCESS, else 1 for ERROR (the caller should fork instead)
+int zygote_exec_cmd(cmd_t * cmd_p, sched_plan_t * sched_p, pid_t * out_pid_p)
+{
+    START_FUNC;
+
+    int result = SUCCESS;
+    int in_fd = -1;
+    int out_fd = -1;
+    int file = -1;
+    string_t args[ cmd_p->argc ];
+    args_to_array( cmd_p, args );
+
+    /* the same fd actions as exec_cmd, but resolved in the shell */
+    if (cmd_p->handler_flags & R_PIPE)
+    {
+        in_fd = cmd_p->fd[ READ_END ];
+    }
+
+    if (cmd_p->handler_flags & W_PIPE)
+    {
+        out_fd = cmd_p->fd[ WRITE_END ];
+    }
+
+    if (cmd_p->handler_flags & W_FILE)
+    { /* bad syntax or a bad file is reported by the fork path */
+        if (cmd_p->argc < 3 || (file = open( args[ cmd_p->argc - 2 ],
+            O_CREAT | O_WRONLY | O_TRUNC, S_IRWXU )) < 0)
+        {
+            result = ERROR;
+            goto FUNC_EXIT;
+        }
+        out_fd = file;
+        args[ cmd_p->argc - 2 ] = NULL; // remove file from args
+    }
+    result = zygote_spawn( args, in_fd, out_fd, sched_p, out_pid_p );
+
+    if (file != -1)
+    { /* the zygote passed its own copy on to the command */
+        close( file );
+    }
+FUNC_EXIT:
+    END_FUNC;
+
+    return result;
+}
+
 /// @brief Fork and execute the command in the child process
 /// @param cmd_p the command to execute in child
-/// @param prev_cmd_p the previously executed command
-void fork_and_exec(cmd_t * cmd_p, cmd_t * prev_cmd_p) 
+/// @param sched_p the scheduling plan for the command
+/// @return the pid of the command, else -1 if it could not be started
+pid_t fork_and_exec(cmd_t * cmd_p, sched_plan_t * sched_p) 
 {
     START_FUNC;
-    int pid;
+    pid_t pid = -1;
 
     if (cmd_p->handler_flags & (W_PIPE | R_PIPE))
     { /* determine if pipes are needed */
         setup_pipes( cmd_p );       // setup any necessary pipes
     }
-    pid = fork();
+
+    if (!zygote_active() || zygote_exec_cmd( cmd_p, sched_p, &pid ))
+    { /* fork the shell itself unless the zygote spawned the command */
+        pid = fork();
+    }
 
     if (pid < 0) 
     {
         PRINT_ERROR( "fork failed!" );
     } else if (pid == 0) 
     { /* child setups any file descriptors and execute the command */
-        exec_cmd( cmd_p ); // does NOT return 
+        exec_cmd( cmd_p, sched_p ); // does NOT return 
     } else            
-    { /* parent closes the file descriptors */
-        if (prev_cmd_p && prev_cmd_p->fd[ READ_END ] != -1)
-        { /* close read end for the previous process */
-            close( prev_cmd_p->fd[ READ_END ] );
+    { /* parent closes the pipe ends the command now holds */
+        if (cmd_p->handler_flags & R_PIPE && cmd_p->fd[ READ_END ] != -1)
+        { /* close the read end this command reads from (only once, the
+            previous command's fd[ READ_END ] may already be a reused fd) */
+            close( cmd_p->fd[ READ_END ] );
         }
-        if (cmd_p->next && cmd_p->fd[ WRITE_END ] != -1)
-        { /* close write end for the current process unless its last */
+        if (cmd_p->handler_flags & W_PIPE && cmd_p->fd[ WRITE_END ] != -1)
+        { /* close write end so the next command sees EOF */
             close( cmd_p->fd[ WRITE_END ] ); 
         }
     }
     END_FUNC;
+
+    return pid;
+}
+
+/// @brief Reaps finished async cmds and (with -z) orphans adopted as
+///        subreaper, freeing any cpu slot an async stage held for pin auto
+void reap_strays()
+{
+    pid_t pid;
+
+    while ((pid = waitpid( -1, NULL, WNOHANG )) > 0)
+    {
+        release_pin_slot( pid );
+    }
 }
 
 /// @brief Executes each of the commands in the command set
@@ -338,26 +464,52 @@ void exec_cmd_set(cmd_set_t * cmd_set_p)
     START_FUNC;
 
     cmd_t * curr_cmd_p = cmd_set_p->head;   // The currently executing cmd
-    cmd_t * prev_cmd_p = NULL;              // The previously executed cmd
+    sched_plan_t sched;                     // The current cmd's scheduling
+    int n_stages = 0;                       // The number of cmds in the set
+    int stage = 0;                          // The current cmd's pipeline index
+    int slot = -1;                          // The first cpu slot (pin auto)
+
+    for (cmd_t * cmd_p = curr_cmd_p; cmd_p; cmd_p = cmd_p->next)
+    {
+        n_stages++;
+    }
+    pid_t pids[ n_stages ];                 // The pid of each cmd
+
+    reap_strays();      // so finished async stages don't keep their slots
+
+    if (pin_auto_enabled() && n_stages > 1)
+    { /* only pipelines are placed, a lone command can run anywhere */
+        slot = auto_place_pipeline( n_stages );
+    }
 
     while (curr_cmd_p)
     { /* performs exection of the current command */
-        fork_and_exec( curr_cmd_p, prev_cmd_p ); // executes current command
-        prev_cmd_p = curr_cmd_p;    // save cmd we can close the read end
+        sched = curr_cmd_p->sched;  // copy so auto placement isn't saved
 
-        if (!(cmd_set_p->async))
-        { /* parent does not wait if the cmd_set has the async flag set */
-            wait( NULL );
-        } // not waiting will cause prompt to disspear until program exit
+        if (slot >= 0)
+        {
+            auto_place_stage( &sched, slot + stage );
+        }
+        pids[ stage ] = fork_and_exec( curr_cmd_p, &sched ); // executes cmd
 
-        if (curr_cmd_p->next)
-        { /* set the current command pointer to the next command */
-            curr_cmd_p = curr_cmd_p->next;
-        } else 
-        { /* when there are no more commands left, then exit loop */
-            curr_cmd_p = prev_cmd_p = NULL;
+        if (slot >= 0 && cmd_set_p->async && pids[ stage ] > 0)
+        { /* a foreground stage is done before the next pipeline is placed */
+            hold_pin_slot( slot + stage, pids[ stage ] );
         }
+        stage++;
+        curr_cmd_p = curr_cmd_p->next;
     }
+
+    for (int i = 0; i < n_stages && !(cmd_set_p->async); i++)
+    { /* every stage was started first so a pipeline's stages run at once;
+        parent does not wait if the cmd_set has the async flag set */
+        if (pids[ i ] > 0)
+        {
+            waitpid( pids[ i ], NULL, 0 );
+        }
+    } // not waiting will cause prompt to disspear until program exit
+
+    reap_strays();
     END_FUNC;
 }
 
@@ -402,6 +554,12 @@ int simulate_shell()
             print_history( hist, cmd_num );     // prints cmd set history
             continue;
 
+        } else if (in_buf[ 0 ] == 'p' && !strncmp( &in_buf[ 1 ], "in", 2 )
+            && (in_buf[ 3 ] == ' ' || in_buf[ 3 ] == '\n'))
+        { /* pin [auto|off] - toggles auto placement of pipeline stages */
+            pin_builtin( in_buf );
+            continue;
+
         } else if (in_buf[ 0 ] == 'r' && in_buf[ 1 ] == ' ') 
         { /* r # - repeats a command in history, non-nums after # are ignored */
             if (fetch_cmd_set( in_buf, hist, cmd_num, &cmd_set_p))
@@ -410,7 +568,11 @@ int simulate_shell()
             }
         } else                                    // new command entered 
         { /* extract the arguments for normal execution */
-            extract_cmds( in_buf, &cmd_set_p );
+            if (extract_cmds( in_buf, &cmd_set_p ))
+            { /* a malformed annotation rejects the whole command set */
+                free_cmd_set( &cmd_set_p );
+                continue;
+            }
         }
         hist_index = cmd_num % HIST_SIZE;
 
@@ -434,10 +596,19 @@ FUNC_EXIT:
 }
 
 /// @brief Main function for running the program
-/// @param argc n/a
-/// @param argv n/a
+/// @param argc the number of command line arguments
+/// @param argv the command line arguments (-z enables the zygote)
 /// @return 0 if SUCCESS, else 1 for ERROR
 int main(int argc, char *argv[])
 {
-    return simulate_shell();
+    int result = SUCCESS;
+
+    if (argc > 1 && !strcmp( argv[ 1 ], "-z" ) && zygote_start())
+    { /* the shell still works without the zygote, it just forks itself */
+        PRINT_ERROR( "zygote failed to start, falling back to fork" );
+    }
+    result = simulate_shell();
+    zygote_stop();
+
+    return result;
 }
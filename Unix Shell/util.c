@@ -77,6 +77,9 @@ int create_cmd(cmd_t ** out_cmd_pp)
         (*out_cmd_pp)->fd[ 0 ] = (*out_cmd_pp)->fd[ 1 ] = -1;
         (*out_cmd_pp)->argc = 1;
         (*out_cmd_pp)->handler_flags = 0;
+        (*out_cmd_pp)->sched.flags = 0;
+        (*out_cmd_pp)->sched.nice = 0;
+        CPU_ZERO( &(*out_cmd_pp)->sched.cpus );
     }
     return result;
 }
@@ -4,9 +4,13 @@
 /// @date 10.19.2023
 ////////////////////////////////////////////////////////////////////////////////
 
+#ifndef UTIL_H
+#define UTIL_H
+
 /***************************** Imports ****************************************/
 
 #include <stdio.h>
+#include <sched.h>
 
 /**************************** Constants ***************************************/
 
@@ -26,6 +30,9 @@
 #define W_PIPE 0b010
 #define W_FILE 0b100
 
+#define PIN_CPU  0b01
+#define PIN_NICE 0b10
+
 /***************************** Macros *****************************************/
 
 void print_debug(char * arg1, const char * f_name, int ln_num, char * sentinel);
@@ -47,6 +54,7 @@ typedef char * string_t;
 typedef struct arg_s arg_t;
 typedef struct cmd_s cmd_t;
 typedef struct cmd_set_s cmd_set_t;
+typedef struct sched_plan_s sched_plan_t;
 
 struct arg_s 
 { /* argument structure (a linked list) */
@@ -54,12 +62,20 @@ struct arg_s
     struct arg_s * next;
 };
 
+struct sched_plan_s
+{ /* scheduling applied to a command before exec (from @cpu= and @nice=) */
+    char flags;         // PIN_CPU and/or PIN_NICE
+    int nice;
+    cpu_set_t cpus;
+};
+
 struct cmd_s 
 { /* command structure (a linked list) */
     arg_t * head; 
     short argc; 
     int fd[ 2 ];
     char handler_flags;
+    sched_plan_t sched;
     struct cmd_s * next; 
 };
 
@@ -81,4 +97,6 @@ int create_cmd(cmd_t **);
 void free_cmd(cmd_t **);
 
 int create_cmd_set(cmd_set_t **);
-void free_cmd_set(cmd_set_t **);
\ No newline at end of file
+void free_cmd_set(cmd_set_t **);
+
+#endif
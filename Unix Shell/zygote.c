@@ -0,0 +1,407 @@
+////////////////////////////////////////////////////////////////////////////////
+/// Fork-server helper which spawns commands on behalf of the shell
+/// @author Thomas Pelegrin
+/// @date 10.19.2023
+////////////////////////////////////////////////////////////////////////////////
+
+/***************************** Imports ****************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "util.h"
+#include "zygote.h"
+#include "affinity.h"
+
+/**************************** Constants ***************************************/
+
+#define MAX_PLAN_FDS 2
+
+/***************************** Globals ****************************************/
+
+extern char ** environ;
+
+static int zygote_sock = -1;    // the shell's end of the zygote socket
+static pid_t zygote_pid = -1;   // the pid of the zygote helper
+
+/*******************************************************************************
+ *                            Functions
+ ******************************************************************************/
+
+/// @brief Reads exactly len bytes from the file descriptor
+/// @param fd the file descriptor to read from
+/// @param buf the buffer to read into
+/// @param len the number of bytes to read
+/// @return 0 if SUCCESS, else 1 for ERROR (or EOF)
+static int read_full(int fd, void * buf, size_t len)
+{
+    ssize_t n = 0;
+    char * p = buf;
+
+    while (len > 0)
+    { /* keep reading until the whole buffer is filled */
+        if ((n = read( fd, p, len )) <= 0)
+        {
+            return ERROR;
+        }
+        p += n;
+        len -= n;
+    }
+    return SUCCESS;
+}
+
+/// @brief Writes exactly len bytes to the socket
+/// @param fd the socket to write to
+/// @param buf the buffer to write from
+/// @param len the number of bytes to write
+/// @return 0 if SUCCESS, else 1 for ERROR
+static int write_full(int fd, const void * buf, size_t len)
+{
+    ssize_t n = 0;
+    const char * p = buf;
+
+    while (len > 0)
+    { /* MSG_NOSIGNAL so a dead zygote doesn't SIGPIPE the shell */
+        if ((n = send( fd, p, len, MSG_NOSIGNAL )) <= 0)
+        {
+            return ERROR;
+        }
+        p += n;
+        len -= n;
+    }
+    return SUCCESS;
+}
+
+/// @brief Splits a buffer of NUL-separated strings into a string array
+/// @param buf the buffer holding the strings
+/// @param count the number of strings in the buffer
+/// @param out_strs the array to fill (must hold count + 1 entries)
+/// @return a pointer to the byte after the last string
+static char * split_strings(char * buf, int count, string_t * out_strs)
+{
+    for (int i = 0; i < count; i++)
+    { /* each string is terminated by its own NUL */
+        out_strs[ i ] = buf;
+        buf += strlen( buf ) + 1;
+    }
+    out_strs[ count ] = NULL;
+
+    return buf;
+}
+
+/// @brief Receives a plan header and any attached file descriptors
+/// @param sock the zygote's end of the socket
+/// @param out_hdr_p where to store the header (output)
+/// @param out_fds where to store the STDIN and STDOUT fds, -1 if absent
+/// @return 0 if SUCCESS, else 1 for ERROR (or the shell hung up)
+static int recv_plan_hdr(int sock, plan_hdr_t * out_hdr_p, int * out_fds)
+{
+    char ctrl[ CMSG_SPACE( sizeof( int ) * MAX_PLAN_FDS ) ];
+    struct iovec iov = { out_hdr_p, sizeof( *out_hdr_p ) };
+    struct msghdr msg = { 0 };
+    struct cmsghdr * cmsg = NULL;
+    int fds[ MAX_PLAN_FDS ] = { -1, -1 };
+    int n_fds = 0;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof( ctrl );
+
+    if (recvmsg( sock, &msg, MSG_WAITALL ) != sizeof( *out_hdr_p ))
+    { /* EOF means the shell has exited */
+        return ERROR;
+    }
+
+    if ((cmsg = CMSG_FIRSTHDR( &msg )) && cmsg->cmsg_level == SOL_SOCKET
+        && cmsg->cmsg_type == SCM_RIGHTS)
+    { /* copy out the fds in the order the shell attached them */
+        n_fds = (cmsg->cmsg_len - CMSG_LEN( 0 )) / sizeof( int );
+        memcpy( fds, CMSG_DATA( cmsg ), sizeof( int ) * n_fds );
+    }
+    n_fds = 0;
+    out_fds[ READ_END ] = out_hdr_p->in_fd ? fds[ n_fds++ ] : -1;
+    out_fds[ WRITE_END ] = out_hdr_p->out_fd ? fds[ n_fds++ ] : -1;
+
+    return SUCCESS;
+}
+
+/// @brief Double forks and executes the plan so the command is reparented to
+///        the shell (a subreaper) and can be waited on there
+/// @param sock the zygote's end of the socket (the grandchild pid goes here)
+/// @param argv the argument array of the command
+/// @param envp the environment of the command
+/// @param fds the STDIN and STDOUT fds for the command, -1 to inherit
+/// @param sched_p the scheduling plan of the command
+static void spawn_plan(int sock, string_t * argv, string_t * envp, int * fds,
+    sched_plan_t * sched_p)
+{
+    START_FUNC;
+
+    int pid_pipe[ 2 ];              // carries the grandchild pid to the zygote
+    pid_t pid = -1;
+
+    if (pipe2( pid_pipe, O_CLOEXEC ) < 0)
+    { /* let the shell know it needs to fall back to fork */
+        PRINT_ERROR( "pipe failed" );
+        write_full( sock, &pid, sizeof( pid ) );
+        goto FUNC_EXIT;
+    }
+    pid = fork();
+
+    if (pid == 0)
+    { /* intermediate: fork the command, report its pid, then exit */
+        pid = fork();
+
+        if (pid == 0)
+        { /* grandchild: apply the fd actions and execute the command */
+            close( sock );
+            apply_sched_plan( sched_p );
+
+            if (fds[ READ_END ] != -1)
+            {
+                dup2( fds[ READ_END ], STDIN_FILENO );
+                close( fds[ READ_END ] );
+            }
+            if (fds[ WRITE_END ] != -1)
+            {
+                dup2( fds[ WRITE_END ], STDOUT_FILENO );
+                close( fds[ WRITE_END ] );
+            }
+            environ = envp;
+
+            if (execvp( argv[ 0 ], argv ) < 0)
+            {
+                PRINT_ERROR( "program not found" );
+                exit( ERROR );
+            }
+        }
+        write( pid_pipe[ WRITE_END ], &pid, sizeof( pid ) );
+        _exit( pid < 0 ? ERROR : SUCCESS );
+    }
+    close( pid_pipe[ WRITE_END ] );
+
+    if (pid < 0)
+    {
+        PRINT_ERROR( "fork failed!" );
+    } else
+    { /* reap the intermediate before answering: only once it is gone has
+        the grandchild been reparented, so the shell's waitpid() can't race */
+        waitpid( pid, NULL, 0 );
+
+        if (read_full( pid_pipe[ READ_END ], &pid, sizeof( pid ) ))
+        {
+            pid = -1;
+        }
+    }
+    close( pid_pipe[ READ_END ] );
+    write_full( sock, &pid, sizeof( pid ) );
+
+FUNC_EXIT:
+    END_FUNC;
+}
+
+/// @brief The zygote's main loop: receives exec plans until the shell exits
+/// @param sock the zygote's end of the socket
+static void zygote_loop(int sock)
+{
+    START_FUNC;
+
+    plan_hdr_t hdr;
+    int fds[ 2 ];
+    char * buf = NULL;
+
+    while (!recv_plan_hdr( sock, &hdr, fds ))
+    { /* each iteration spawns one command */
+        string_t argv[ hdr.argc + 1 ];
+        string_t envp[ hdr.envc + 1 ];
+
+        if (!(buf = (char *) malloc( hdr.len ))
+            || read_full( sock, buf, hdr.len ))
+        {
+            PRINT_ERROR( "failed to read exec plan" );
+            break;
+        }
+        split_strings( split_strings( buf, hdr.argc, argv ), hdr.envc, envp );
+
+        spawn_plan( sock, argv, envp, fds, &hdr.sched );
+
+        if (fds[ READ_END ] != -1)
+        { /* the command holds its own copies now */
+            close( fds[ READ_END ] );
+        }
+        if (fds[ WRITE_END ] != -1)
+        {
+            close( fds[ WRITE_END ] );
+        }
+        free( buf );
+        buf = NULL;
+    }
+    free( buf );
+    END_FUNC;
+
+    exit( SUCCESS );
+}
+
+/// @brief Forks the zygote while the shell is still small so that spawning
+///        no longer copies the shell's (growing) page tables
+/// @return 0 if SUCCESS, else 1 for ERROR
+int zygote_start(void)
+{
+    START_FUNC;
+
+    int result = SUCCESS;
+    int sv[ 2 ];
+
+    if (prctl( PR_SET_CHILD_SUBREAPER, 1 ) < 0)
+    { /* needed so commands are reparented to the shell, not to init */
+        PRINT_ERROR( "prctl failed" );
+        result = ERROR;
+
+    } else if (socketpair( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv ) < 0)
+    {
+        PRINT_ERROR( "socketpair failed" );
+        result = ERROR;
+
+    } else if ((zygote_pid = fork()) < 0)
+    {
+        PRINT_ERROR( "fork failed!" );
+        close( sv[ 0 ] );
+        close( sv[ 1 ] );
+        result = ERROR;
+
+    } else if (zygote_pid == 0)
+    { /* the zygote only needs its own end of the socket */
+        close( sv[ 0 ] );
+        zygote_loop( sv[ 1 ] ); // does NOT return
+
+    } else
+    {
+        close( sv[ 1 ] );
+        zygote_sock = sv[ 0 ];
+    }
+    END_FUNC;
+
+    return result;
+}
+
+/// @brief Checks whether commands should be spawned through the zygote
+/// @return TRUE if the zygote is running, else FALSE
+int zygote_active(void)
+{
+    return zygote_sock != -1;
+}
+
+/// @brief Sends an exec plan to the zygote and waits for the spawned pid
+/// @param argv the NULL terminated argument array of the command
+/// @param in_fd the fd to use as STDIN, -1 to inherit
+/// @param out_fd the fd to use as STDOUT, -1 to inherit
+/// @param sched_p the scheduling plan of the command
+/// @param out_pid_p where to store the pid of the command (output)
+/// @return 0 if SUCCESS, else 1 for ERROR
+int zygote_spawn(string_t * argv, int in_fd, int out_fd, sched_plan_t * sched_p,
+    pid_t * out_pid_p)
+{
+    START_FUNC;
+
+    int result = SUCCESS;
+    plan_hdr_t hdr = { 0 };
+    char ctrl[ CMSG_SPACE( sizeof( int ) * MAX_PLAN_FDS ) ];
+    struct iovec iov = { &hdr, sizeof( hdr ) };
+    struct msghdr msg = { 0 };
+    struct cmsghdr * cmsg = NULL;
+    int fds[ MAX_PLAN_FDS ];
+    int n_fds = 0;
+    char * buf = NULL;
+    char * p = NULL;
+
+    hdr.sched = *sched_p;
+
+    for (hdr.argc = 0; argv[ hdr.argc ]; hdr.argc++)
+    { /* measure argv */
+        hdr.len += strlen( argv[ hdr.argc ] ) + 1;
+    }
+    for (hdr.envc = 0; environ[ hdr.envc ]; hdr.envc++)
+    { /* measure envp */
+        hdr.len += strlen( environ[ hdr.envc ] ) + 1;
+    }
+
+    if (in_fd != -1)
+    {
+        hdr.in_fd = TRUE;
+        fds[ n_fds++ ] = in_fd;
+    }
+    if (out_fd != -1)
+    {
+        hdr.out_fd = TRUE;
+        fds[ n_fds++ ] = out_fd;
+    }
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (n_fds > 0)
+    { /* pass the fds along with the header */
+        msg.msg_control = ctrl;
+        msg.msg_controllen = CMSG_SPACE( sizeof( int ) * n_fds );
+        cmsg = CMSG_FIRSTHDR( &msg );
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN( sizeof( int ) * n_fds );
+        memcpy( CMSG_DATA( cmsg ), fds, sizeof( int ) * n_fds );
+    }
+
+    if (!(p = buf = (char *) malloc( hdr.len )))
+    {
+        PRINT_ERROR( "malloc failed" );
+        result = ERROR;
+        goto FUNC_EXIT;
+    }
+    for (int i = 0; i < hdr.argc; i++)
+    { /* serialize argv as NUL-separated strings */
+        p = stpcpy( p, argv[ i ] ) + 1;
+    }
+    for (int i = 0; i < hdr.envc; i++)
+    { /* followed by envp */
+        p = stpcpy( p, environ[ i ] ) + 1;
+    }
+
+    if (sendmsg( zygote_sock, &msg, MSG_NOSIGNAL ) != sizeof( hdr )
+        || write_full( zygote_sock, buf, hdr.len )
+        || read_full( zygote_sock, out_pid_p, sizeof( *out_pid_p ) ))
+    { /* the zygote is gone, so stop using it */
+        PRINT_ERROR( "zygote not responding" );
+        zygote_stop();
+        result = ERROR;
+
+    } else if (*out_pid_p < 0)
+    {
+        result = ERROR;
+    }
+    free( buf );
+
+FUNC_EXIT:
+    END_FUNC;
+
+    return result;
+}
+
+/// @brief Hangs up on the zygote (which then exits) and reaps it
+void zygote_stop(void)
+{
+    START_FUNC;
+
+    if (zygote_sock != -1)
+    {
+        close( zygote_sock );
+        zygote_sock = -1;
+        waitpid( zygote_pid, NULL, 0 );
+        zygote_pid = -1;
+    }
+    END_FUNC;
+}
@@ -0,0 +1,36 @@
+////////////////////////////////////////////////////////////////////////////////
+/// Fork-server helper which spawns commands on behalf of the shell
+/// @author Thomas Pelegrin
+/// @date 10.19.2023
+////////////////////////////////////////////////////////////////////////////////
+
+/***************************** Imports ****************************************/
+
+#include <sys/types.h>
+
+#include "util.h"
+
+/*******************************************************************************
+ *                       Type and Struct Definitions
+ ******************************************************************************/
+
+typedef struct plan_hdr_s plan_hdr_t;
+
+struct plan_hdr_s
+{ /* header of a serialized exec plan sent to the zygote */
+    int argc;           // number of strings in argv (excluding NULL)
+    int envc;           // number of strings in envp (excluding NULL)
+    int len;            // total bytes of the NUL-separated strings that follow
+    int in_fd;          // TRUE if a STDIN fd is attached
+    int out_fd;         // TRUE if a STDOUT fd is attached
+    sched_plan_t sched; // affinity and nice to apply before exec
+};
+
+/*******************************************************************************
+ *                          Public Functions
+ ******************************************************************************/
+
+int zygote_start(void);
+int zygote_active(void);
+int zygote_spawn(string_t *, int, int, sched_plan_t *, pid_t *);
+void zygote_stop(void);
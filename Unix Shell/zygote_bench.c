@@ -0,0 +1,120 @@
+////////////////////////////////////////////////////////////////////////////////
+/// Measures spawn latency of fork versus the zygote at a given shell RSS
+/// @author Thomas Pelegrin
+/// @date 10.19.2023
+////////////////////////////////////////////////////////////////////////////////
+
+/***************************** Imports ****************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "util.h"
+#include "zygote.h"
+
+/**************************** Constants ***************************************/
+
+#define DEFAULT_RUNS 200
+#define BYTES_PER_MB (1 << 20)
+
+/*******************************************************************************
+ *                            Functions
+ ******************************************************************************/
+
+/// @brief Gets the current time in microseconds
+/// @return the monotonic clock in microseconds
+static double now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/// @brief Main function for running the benchmark
+/// @param argc the number of command line arguments
+/// @param argv the RSS to inflate to in MB, and optionally the number of runs
+/// @return 0 if SUCCESS, else 1 for ERROR
+int main(int argc, char *argv[])
+{
+    string_t args[] = { "/bin/true", NULL };
+    sched_plan_t sched = { 0 };
+    size_t mb = 0;
+    int runs = DEFAULT_RUNS;
+    char * rss = NULL;
+    double start = 0;
+    double fork_us = 0;
+    double zygote_us = 0;
+    pid_t pid = -1;
+    int fork_failed = 0;
+    int zygote_failed = 0;
+
+    if (argc < 2)
+    {
+        printf( "Usage: %s RSS_MB [RUNS]\n", argv[ 0 ] );
+        return ERROR;
+    }
+    mb = strtoul( argv[ 1 ], NULL, 10 );
+    runs = argc > 2 ? atoi( argv[ 2 ] ) : DEFAULT_RUNS;
+
+    /* start the zygote while small, just like the shell does with -z */
+    if (zygote_start())
+    {
+        return ERROR;
+    }
+
+    if (mb > 0 && !(rss = (char *) malloc( mb * BYTES_PER_MB )))
+    {
+        PRINT_ERROR( "malloc failed" );
+        zygote_stop();
+        return ERROR;
+    }
+    if (rss)
+    { /* touch every page so it's resident */
+        memset( rss, 1, mb * BYTES_PER_MB );
+    }
+
+    start = now_us();
+    for (int i = 0; i < runs; i++)
+    { /* what fork_and_exec does without -z */
+        if ((pid = fork()) == 0)
+        {
+            execv( args[ 0 ], args );
+            _exit( ERROR );
+        }
+        if (pid < 0 || waitpid( pid, NULL, 0 ) < 0)
+        {
+            fork_failed++;
+        }
+    }
+    fork_us = (now_us() - start) / runs;
+
+    start = now_us();
+    for (int i = 0; i < runs; i++)
+    { /* what fork_and_exec does with -z */
+        if (zygote_spawn( args, -1, -1, &sched, &pid )
+            || waitpid( pid, NULL, 0 ) < 0)
+        { /* a spawn that wasn't waited on doesn't count as a measurement */
+            zygote_failed++;
+        }
+    }
+    zygote_us = (now_us() - start) / runs;
+
+    zygote_stop();
+    free( rss );
+
+    if (fork_failed || zygote_failed)
+    { /* a failed run returns early, so the average would look too good */
+        printf( "failed spawns or waits: fork %d, zygote %d (of %d)\n",
+            fork_failed, zygote_failed, runs );
+        return ERROR;
+    }
+    printf( "RSS %zu MB, %d runs: fork %.1f us, zygote %.1f us per spawn\n",
+        mb, runs, fork_us, zygote_us );
+
+    return SUCCESS;
+}